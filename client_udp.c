@@ -10,16 +10,23 @@ int main(int argc, char * argv[])
   char buf[MAX_LINE];
   int s;
   int slen;
+  int busyPollUs = 0;
+  int verified;
 
-  if (argc==3) {
+  if (argc==3 || argc==4) {
     host = argv[1];
     fname= argv[2];
+    //optional: low-latency mode, spinning up to this many us (or BUSY_POLL_DEFAULT_US, for "-l") for each ACK before blocking
+    if (argc==4) {
+      busyPollUs = parseBusyPollArg(argv[3]);
+    }
   }
   else {
-    fprintf(stderr, "Usage: ./client_udp host filename\n");
+    fprintf(stderr, "Usage: ./client_udp host filename [-l | busy_poll_us]\n");
     exit(1);
   }
   /* translate host name into peer’s IP address */
+  hp = gethostbyname(host);
   if (!hp) {
     fprintf(stderr, "Unknown host: %s\n", host);
     exit(1);
@@ -31,7 +38,6 @@ int main(int argc, char * argv[])
     exit(1);
   }
 
-  hp = gethostbyname(host);
   /* build address data structure */
   bzero((char *)&sin, sizeof(sin));
   sin.sin_family = AF_INET;
@@ -45,9 +51,10 @@ int main(int argc, char * argv[])
   }
 
   socklen_t sock_len= sizeof sin;
+  setBusyPoll(s,busyPollUs);
 
   printf("Sending file\r\n");
-  SendFile(fp,s,&sin);
+  verified = SendFile(fp,s,&sin);
   
   *buf = 0x02;  
     if(sendto(s, buf, 1, 0, (struct sockaddr *)&sin, sock_len)<0){
@@ -55,6 +62,9 @@ int main(int argc, char * argv[])
     exit(1);
   }
   fclose(fp);
+
+  //nonzero exit if the receiver's output doesn't match the file sent
+  return verified ? 0 : 1;
 }
 
 
@@ -1,4 +1,4 @@
-#include "common.h"
+#include "manifest.h"
 
 //// Super simplified serialization: raw memcpy between Packet/buffer. Needs more testing; this may depend on endianness of end systems.
 void serializePacket(struct Packet* pkt, byte buf[RXTX_BUFFER_SIZE])
@@ -173,6 +173,250 @@ void setSocketTimeout(int sockfd, int timeout_s, int timeout_us)
   setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv,sizeof(struct timeval));
 }
 
+//spin budget for recvBusyPoll; zero means plain blocking receives (the default)
+static int busyPollBudgetUs = 0;
+//loss metrics for this process's socket
+static struct LinkStats linkStats;
+
+/*
+Grows one socket buffer (SO_RCVBUF or SO_SNDBUF) to bytes, per setSocketBuffers. Returns its size, as the kernel
+reports it less its bookkeeping overhead (Linux reports double the size set).
+*/
+static int growSocketBuffer(int sockfd, int opt, int bytes)
+{
+  int current = 0;
+  socklen_t optLen = sizeof(int);
+
+  getsockopt(sockfd, SOL_SOCKET, opt, (void *)&current, &optLen);
+  current /= 2;
+
+  bytes = bytes < MIN_SOCKET_BUFFER ? MIN_SOCKET_BUFFER : bytes;
+  bytes = bytes > MAX_SOCKET_BUFFER ? MAX_SOCKET_BUFFER : bytes;
+  if(bytes <= current){
+    return current;
+  }
+
+  if(setsockopt(sockfd, SOL_SOCKET, opt, (void *)&bytes, sizeof(int)) < 0){
+    printf("WARN can't set socket buffer to %d bytes: %s\r\n",bytes,strerror(errno));
+  }
+  optLen = sizeof(int);
+  getsockopt(sockfd, SOL_SOCKET, opt, (void *)&current, &optLen);
+
+  return current / 2;
+}
+
+/*
+Grows both SO_RCVBUF and SO_SNDBUF to at least bytes, up to MAX_SOCKET_BUFFER (the kernel may clamp lower, at
+net.core.rmem_max/wmem_max). Never shrinks them: the floor is the larger of MIN_SOCKET_BUFFER and what the socket
+already has, which starts at the kernel default. Returns the receive buffer size granted, which LinkStats records.
+*/
+int setSocketBuffers(int sockfd, int bytes)
+{
+  int granted;
+
+  granted = growSocketBuffer(sockfd, SO_RCVBUF, bytes);
+  growSocketBuffer(sockfd, SO_SNDBUF, bytes);
+  printf("Socket buffers: asked for %d bytes, receive buffer is %d\r\n",bytes,granted);
+  linkStats.socketBuffer = granted;
+
+  return granted;
+}
+
+//Asks the kernel to report, with each received datagram, how many it has dropped from this socket's full receive queue
+void enableDropCounting(int sockfd)
+{
+#ifdef SO_RXQ_OVFL
+  int on = 1;
+
+  if(setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, (void *)&on, sizeof(int)) < 0){
+    printf("WARN SO_RXQ_OVFL not set (%s), receive queue drops won't be counted\r\n",strerror(errno));
+  }
+#endif
+}
+
+const struct LinkStats* getLinkStats()
+{
+  return &linkStats;
+}
+
+//Prints the drop count and buffer size; a sender, which waits on acks, also gets how its ack timeouts split
+void printLinkStats(int isSender)
+{
+  printf("Link: %u datagrams dropped by full receive queue; socket receive buffer %d bytes\r\n",linkStats.rxQueueDrops,linkStats.socketBuffer);
+  if(isSender){
+    printf("Link: %d ack timeouts from local overflow, %d from path loss\r\n",linkStats.localOverflows,linkStats.pathLosses);
+  }
+}
+
+/*
+recvfrom, via recvmsg so the SO_RXQ_OVFL drop counter can be read off the datagram. The kernel only attaches
+the counter (a running total for the socket) once it is nonzero.
+*/
+static int recvCountingDrops(int sock, void* buf, int len, int flags, struct sockaddr_in* addr, socklen_t* addrLen)
+{
+  int rxed;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(unsigned int))];
+
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  memset((void*)&msg,0,sizeof(struct msghdr));
+  msg.msg_name = addr;
+  msg.msg_namelen = *addrLen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  rxed = recvmsg(sock, &msg, flags);
+  if(rxed >= 0){
+    *addrLen = msg.msg_namelen;
+#ifdef SO_RXQ_OVFL
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+      if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL){
+        memcpy((void*)&linkStats.rxQueueDrops, CMSG_DATA(cmsg), sizeof(unsigned int));
+      }
+    }
+#endif
+  }
+
+  return rxed;
+}
+
+/*
+Enables low-latency mode on a socket: receivers spin on non-blocking reads for up to budget_us
+before falling back to a blocking recvfrom. Where the kernel supports it, SO_BUSY_POLL is also set
+so that blocking reads poll the device queue instead of sleeping. Pass 0 to disable.
+*/
+void setBusyPoll(int sockfd, int budget_us)
+{
+  busyPollBudgetUs = budget_us > 0 ? budget_us : 0;
+
+#ifdef SO_BUSY_POLL
+  if(busyPollBudgetUs > 0 && setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, (void *)&busyPollBudgetUs, sizeof(int)) < 0){
+    //raising SO_BUSY_POLL above net.core.busy_read requires CAP_NET_ADMIN; spinning in userspace still works
+    printf("WARN SO_BUSY_POLL not set (%s), spinning in userspace only\r\n",strerror(errno));
+  }
+#endif
+}
+
+//Parses the optional low-latency argument: "-l" for the default spin budget, else the budget in us
+int parseBusyPollArg(const char* arg)
+{
+  return strcmp(arg, "-l") == 0 ? BUSY_POLL_DEFAULT_US : atoi(arg);
+}
+
+/*
+The receive utility for the latency-sensitive paths. In low-latency mode, spins on MSG_DONTWAIT reads
+until a datagram arrives or the busy-poll budget is spent; then (or if low-latency mode is off) does a
+normal blocking recvfrom, which honors any SO_RCVTIMEO set on the socket. Either way, the kernel's
+receive queue drop count (see enableDropCounting) is picked up from the datagram.
+
+Returns: the recvfrom result; on -1, errno is that of the last recvfrom call.
+*/
+int recvBusyPoll(int sock, void* buf, int len, struct sockaddr_in* addr, socklen_t* addrLen)
+{
+  int rxed;
+  struct timespec start, now;
+
+  if(busyPollBudgetUs > 0){
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do{
+      rxed = recvCountingDrops(sock, buf, len, MSG_DONTWAIT, addr, addrLen);
+      if(rxed >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)){
+        return rxed;
+      }
+      //give up the cpu between polls, in case the peer is waiting to run on this core
+      sched_yield();
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    }while(elapsedUs(&start, &now) < busyPollBudgetUs);
+  }
+
+  return recvCountingDrops(sock, buf, len, 0, addr, addrLen);
+}
+
+long elapsedUs(const struct timespec* start, const struct timespec* end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000L;
+}
+
+//Histogram bucket of a latency: exact below LATENCY_LINEAR_US, then LATENCY_SUB_BUCKETS per doubling
+static int latencyBucket(long us)
+{
+  int e;
+
+  if(us < LATENCY_LINEAR_US){
+    return us < 0 ? 0 : (int)us;
+  }
+  for(e = LATENCY_LINEAR_BITS; e < LATENCY_LINEAR_BITS + LATENCY_DOUBLINGS - 1 && (us >> (e + 1)) != 0; e++);
+  if((us >> (e + 1)) != 0){
+    return LATENCY_BUCKETS - 1;
+  }
+
+  return LATENCY_LINEAR_US + (e - LATENCY_LINEAR_BITS) * LATENCY_SUB_BUCKETS + (int)((us >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+//Smallest latency in a histogram bucket; the inverse of latencyBucket
+static long bucketLatency(int bucket)
+{
+  int e, sub;
+
+  if(bucket < LATENCY_LINEAR_US){
+    return bucket;
+  }
+  e = (bucket - LATENCY_LINEAR_US) / LATENCY_SUB_BUCKETS + LATENCY_LINEAR_BITS;
+  sub = (bucket - LATENCY_LINEAR_US) % LATENCY_SUB_BUCKETS;
+
+  return (long)(LATENCY_SUB_BUCKETS + sub) << (e - LATENCY_SUB_BITS);
+}
+
+//Adds a per-message latency sample (in us)
+void recordLatency(struct LatencyStats* stats, long us)
+{
+  if(stats->numSamples == 0 || us < stats->min){
+    stats->min = us;
+  }
+  if(stats->numSamples == 0 || us > stats->max){
+    stats->max = us;
+  }
+  stats->counts[latencyBucket(us)]++;
+  stats->numSamples++;
+}
+
+//Latency at a nearest-rank percentile; above LATENCY_LINEAR_US, it's the low end of its bucket (within 1/LATENCY_SUB_BUCKETS)
+static long latencyPercentile(const struct LatencyStats* stats, int percent)
+{
+  long rank, seen;
+  int i;
+
+  rank = (stats->numSamples * percent + 99) / 100;
+  if(rank < 1){
+    rank = 1;
+  }
+  for(i = 0, seen = 0; i < LATENCY_BUCKETS - 1; i++){
+    seen += stats->counts[i];
+    if(seen >= rank){
+      break;
+    }
+  }
+
+  return bucketLatency(i) < stats->min ? stats->min : bucketLatency(i);
+}
+
+//Prints min/median/p99/max of the recorded per-message latencies (in us)
+void printLatencyStats(const struct LatencyStats* stats)
+{
+  if(stats->numSamples <= 0){
+    printf("Latency: no samples\r\n");
+    return;
+  }
+
+  printf("Latency over %ld data messages (us): min=%ld median=%ld p99=%ld max=%ld\r\n",
+    stats->numSamples, stats->min, latencyPercentile(stats, 50), latencyPercentile(stats, 99), stats->max);
+}
+
 /*
 Constructs a packet from data by:
   -cleaning old packet contents (freeing old data)
@@ -185,34 +429,45 @@ To make an empty packet (such as ACK/NACK packets), pass NULL or 0 for "char* da
 */
 void makePacket(int seqnum, int ack, byte* data, struct Packet* pkt)
 {
-  int dataLen, checksum, i;
-  cleanPacket(pkt);
+  int dataLen = data != 0 ? strnlen((char*)data,PKT_DATA_MAX_LEN) : 0;
 
   //testByteConversion();
 
+  if(dataLen > PKT_DATA_MAX_LEN - 32){
+    printf("ERROR length of data too long in makePacket: %d\r\n",dataLen);
+  }
+  buildPacket(seqnum,ack,data,dataLen,pkt);
+  printf("datalen=%d\r\n",dataLen);
+
+  printf("pkt source data: seqnum=%d ACK=%d data=%s\r\n",seqnum,ack,(char*)data);
+  printPacket(pkt);
+}
+
+/*
+makePacket without any logging, for the hot paths (eg, the receiver's ACKs), and with an explicit data
+length, so data needn't be a null-terminated string.
+*/
+void buildPacket(int seqnum, int ack, const byte* data, int dataLen, struct Packet* pkt)
+{
+  int checksum;
+  cleanPacket(pkt);
+
   //set the sequence number  
   lintToBytes(seqnum,pkt->seqnum);
 
-  //copy in the data, if any
-  if(data != 0){
-    dataLen = strnlen((char*)data,PKT_DATA_MAX_LEN);
-    lintToBytes(dataLen, pkt->dataLen);
-    if(dataLen > PKT_DATA_MAX_LEN - 32){
-      printf("ERROR length of data too long in makePacket: %d\r\n",dataLen);
-    }
-    strncpy((char*)pkt->data,data,dataLen);
-    printf("datalen=%d\r\n",dataLen);
-  }
-  else{
-    lintToBytes(0,pkt->dataLen);
-    memset((void*)pkt->data,0,PKT_DATA_MAX_LEN);
+  //copy in the data, if any (cleanPacket already zeroed the rest)
+  dataLen = data != 0 && dataLen > 0 ? dataLen : 0;
+  dataLen = dataLen < PKT_DATA_MAX_LEN ? dataLen : PKT_DATA_MAX_LEN - 1;
+  lintToBytes(dataLen, pkt->dataLen);
+  if(dataLen > 0){
+    memcpy((void*)pkt->data,(void*)data,dataLen);
   }
   
   //do the data checksum; must be done before the header checksum
   setDataChecksum(pkt);
   
-  //set the ack field (also must be done before cksum)
-  pkt->ack = ack == ACK ? (byte)ACK : (byte)NACK;
+  //set the ack field, which doubles as the packet type (also must be done before cksum)
+  pkt->ack = (ack == ACK || ack == MANIFEST || ack == BLOCK_COPY || ack == DIGEST) ? (byte)ack : (byte)NACK;
   
   //an apparent sequence of bytes, when viewed in wireshark
   pkt->name[0] = 'Z';
@@ -223,9 +478,6 @@ void makePacket(int seqnum, int ack, byte* data, struct Packet* pkt)
   //must be done only after data checksum is set
   checksum = getHeaderChecksum(pkt);
   lintToBytes(checksum,pkt->hdrChecksum);
-
-  printf("pkt source data: seqnum=%d ACK=%d data=%s\r\n",seqnum,ack,(char*)data);
-  printPacket(pkt);
 }
 
 void printRawPacket(const struct Packet* pkt)
@@ -253,37 +505,343 @@ void printPacket(const struct Packet* pkt)
   //gets(buf);
 }
 
+//State of one file transfer on the sender side
+struct SendSession{
+  int sock;
+  struct sockaddr_in* sin;
+  //alternates between 0 and 1, per the alternating bit protocol
+  int seqnum;
+  //per-message send-to-ack times of data messages, for reporting tail latency
+  struct LatencyStats latencies;
+  //receives each ACK, and any reply data it carries
+  struct Packet ackPkt;
+  //set once a request goes unacked; the receiver is unreachable, so nothing more is sent
+  int failed;
+};
+
+//A manifest block, keyed by its weak checksum; sorted by weak so candidate blocks can be binary searched
+struct WeakIndex{
+  unsigned int weak;
+  int block;
+};
+
+//TRUE if the last request was a BLOCK_COPY the receiver refused, ie NACKed
+static int isRefused(const struct SendSession* ss)
+{
+  return ss->ackPkt.ack == NACK && bytesToLint(ss->ackPkt.seqnum) == ss->seqnum;
+}
+
+/*
+Sends one request of dataLen bytes reliably and records its ACK wait. Returns TRUE once the request is acked.
+The seqnum only advances then: a refused request wasn't taken by the receiver, so its seqnum is still due.
+Any other failure fails the session, since the receiver may or may not have taken the request.
+*/
+static int sessionSend(struct SendSession* ss, int type, const byte* data, int dataLen)
+{
+  int result;
+  long ackWaitUs;
+
+  if(ss->failed){
+    return FALSE;
+  }
+  result = SendRequest(ss->sock,ss->sin,ss->seqnum,type,data,dataLen,&ss->ackPkt,&ackWaitUs);
+  if(!result && !(type == BLOCK_COPY && isRefused(ss))){
+    printf("ERROR request unacked, abandoning the session\r\n");
+    ss->failed = TRUE;
+  }
+
+  //only plain data messages are sampled: control requests (MANIFEST, BLOCK_COPY, DIGEST) wait on receiver
+  //file io, not just the link, and would swamp the per-message tail
+  if(type == ACK){
+    recordLatency(&ss->latencies, ackWaitUs);
+  }
+
+  //update seqnum, which in this case just alternates between 0 and 1
+  if(result){
+    ss->seqnum++;
+    ss->seqnum %= 2;
+  }
+
+  return result;
+}
+
+//Sends raw bytes as data packets, a line (or MAX_LINE-1 bytes, whichever is shorter) per packet. Lengths are explicit, so any bytes may be sent.
+static void sendLiteral(struct SendSession* ss, const byte* data, int len)
+{
+  int n;
+
+  while(len > 0){
+    for(n = 0; n < len && n < MAX_LINE - 1 && (n == 0 || data[n-1] != '\n'); n++);
+    sessionSend(ss, ACK, data, n);
+    data += n;
+    len -= n;
+  }
+}
+
+/*
+Sends a run of count (at most MAX_COPY_BLOCKS) receiver blocks, starting at block first, which match the stream's
+bytes at data. If the receiver refuses the copy, those bytes are sent as data instead. Returns the number of bytes copied.
+*/
+static int sendBlockCopy(struct SendSession* ss, int first, int count, const byte* data)
+{
+  char buf[MAX_LINE];
+
+  snprintf(buf, MAX_LINE, "%d %d", first, count);
+  if(sessionSend(ss, BLOCK_COPY, (byte*)buf, strlen(buf))){
+    return count * SYNC_BLOCK_SIZE;
+  }
+
+  if(!ss->failed){
+    printf("WARN receiver can't copy %d blocks from block %d, sending them as data\r\n",count,first);
+    sendLiteral(ss, data, count * SYNC_BLOCK_SIZE);
+  }
+  return 0;
+}
+
+//Fetches the receiver's manifest of its existing (or partial) output file, a page at a time
+static void fetchManifest(struct SendSession* ss, struct Manifest* m)
+{
+  int totalBlocks = 0, n, stale = 0;
+  char buf[MAX_LINE];
+
+  do{
+    snprintf(buf, MAX_LINE, "%d", m->numBlocks);
+    if(!sessionSend(ss, MANIFEST, (byte*)buf, strlen(buf))){
+      break;
+    }
+    //a page starting at some other block is a late reply to an earlier request; ask again
+    n = decodeManifestPage((char*)ss->ackPkt.data, m, &totalBlocks);
+    if(n < 0){
+      printf("WARN discarding stale manifest page\r\n");
+      stale++;
+    }
+  }while(n != 0 && stale < MAX_RETRY_COUNT && (n < 0 || m->numBlocks < totalBlocks));
+
+  printf("Receiver has %d blocks of %d bytes\r\n",m->numBlocks,SYNC_BLOCK_SIZE);
+}
+
+static int compareWeakIndex(const void* a, const void* b)
+{
+  unsigned int x = ((const struct WeakIndex*)a)->weak, y = ((const struct WeakIndex*)b)->weak;
+  return (x > y) - (x < y);
+}
+
+static struct WeakIndex* buildWeakIndex(const struct Manifest* m)
+{
+  int i;
+  struct WeakIndex* index = (struct WeakIndex*)malloc((m->numBlocks + 1) * sizeof(struct WeakIndex));
+
+  if(index == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  for(i = 0; i < m->numBlocks; i++){
+    index[i].weak = m->sigs[i].weak;
+    index[i].block = i;
+  }
+  qsort(index, m->numBlocks, sizeof(struct WeakIndex), compareWeakIndex);
+
+  return index;
+}
+
+/*
+Looks up the receiver block matching the SYNC_BLOCK_SIZE bytes at window, whose weak checksum is weak.
+The strong hash is only computed if some block's weak checksum matches. Where several blocks match,
+prefers block "preferred" (the one extending the current copy run). Returns the block, or -1.
+*/
+static int findBlock(const struct Manifest* m, const struct WeakIndex* index, const byte* window, unsigned int weak, int preferred)
+{
+  int lo = 0, hi = m->numBlocks, mid, match = -1;
+  unsigned long long strong = 0;
+
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    if(index[mid].weak < weak)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for(; lo < m->numBlocks && index[lo].weak == weak; lo++){
+    if(strong == 0){
+      strong = strongHash(window, SYNC_BLOCK_SIZE);
+    }
+    if(m->sigs[index[lo].block].strong == strong){
+      if(index[lo].block == preferred){
+        return preferred;
+      }
+      match = match < 0 ? index[lo].block : match;
+    }
+  }
+
+  return match;
+}
+
+/*
+Sends what's pending behind the window: the copy run, whose bytes end at buf + litStart, then the bytes from
+litStart to end as data. Returns the number of bytes copied.
+*/
+static int flushPending(struct SendSession* ss, const byte* buf, int copyFirst, int copyCount, int litStart, int end)
+{
+  int copied = 0;
+
+  if(copyCount > 0){
+    copied = sendBlockCopy(ss, copyFirst, copyCount, buf + litStart - copyCount * SYNC_BLOCK_SIZE);
+  }
+  sendLiteral(ss, buf + litStart, end - litStart);
+
+  return copied;
+}
+
 /*
 Top level function for sending some file/stream. This implements the Kurose/Ross state rdt3.0 machine.
+
+Transfers are delta-synced, rsync style: the sender first fetches the receiver's manifest of its existing
+(or partially received) output file, then rolls a weak checksum across the stream to find blocks the receiver
+already has. Those go on the wire as BLOCK_COPY runs; only the bytes between them are sent as data.
+
+The stream passes through a STREAM_BUFFER_SIZE buffer, so the sender's memory doesn't grow with the file:
+the buffer holds the pending copy run and data, and a block of lookahead for the rolling match.
+
+At session close, the sender's whole-file digest (hashed as the stream was read) is exchanged with the
+receiver's (hashed as the output was written). Returns TRUE if they match, ie the output file is verified.
 */
-void SendFile(FILE* fptr, int sock, struct sockaddr_in* sin)
+int SendFile(FILE* fptr, int sock, struct sockaddr_in* sin)
 {
-  int seqnum;
-  int slen;
-  char buf[128];
-  
-  memset(buf,0,128);
+  byte* buf;
+  int bufLen, keep, n, eof, pos, litStart, match, copyFirst, copyCount, haveWeak, verified;
+  long long len, copied;
+  unsigned int weak = 0;
+  byte digest[SHA256_LEN];
+  char digestHex[MAX_LINE];
+  struct Manifest manifest;
+  struct WeakIndex* index;
+  struct TreeDigest tree;
+  struct SendSession ss;
 
   //set socket options; this assumes its safe to overwrite any previous socket options!
   //also: this is a requirement of the client state machine, which isn't apparent at this level. clean this if code is reused.
-  setSocketTimeout(sock,0,250000); // sets a 0.25s max wait time for ACK receipt
+  setSocketTimeout(sock,0,ACK_TIMEOUT_US); // sets a 0.25s max wait time for ACK receipt
 
-  /* main loop: get and send lines of text */
-  seqnum = 0;
-  while(fgets(buf, 80, fptr) != NULL){
-    slen = strnlen(buf,80);
-    buf[slen] ='\0';
+  //at least a window's worth of buffer; SendRequest grows it if acks are dropped by a full receive queue
+  setSocketBuffers(sock, MIN_SOCKET_BUFFER);
+  enableDropCounting(sock);
 
-    SendData(sock,sin,seqnum,(byte*)buf);
-    
-    //update seqnum, which in this case just alternates between 0 and 1
-    seqnum++;
-    seqnum %= 2;
-  }  
+  memset((void*)&ss,0,sizeof(struct SendSession));
+  ss.sock = sock;
+  ss.sin = sin;
+
+  buf = (byte*)malloc(STREAM_BUFFER_SIZE);
+  if(buf == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  initTreeDigest(&tree);
+  initManifest(&manifest);
+  fetchManifest(&ss,&manifest);
+  index = buildWeakIndex(&manifest);
+
+  /*
+  main loop: slide a block-sized window over the stream. On a match, flush the unmatched bytes before
+  the window as data, add the block to the pending copy run (sent once it breaks, or reaches MAX_COPY_BLOCKS),
+  and jump past it; otherwise roll one byte.
+  buf holds the pending copy run's bytes (in case the receiver refuses the copy), then the pending data from
+  litStart, then the window at pos and the lookahead past it.
+  */
+  len = copied = 0;
+  bufLen = pos = litStart = 0;
+  copyFirst = -1;
+  copyCount = 0;
+  haveWeak = FALSE;
+  eof = FALSE;
+  while(!ss.failed){
+    //refill, to keep a whole block in the window until the end of the stream
+    if(pos + SYNC_BLOCK_SIZE > bufLen && !eof){
+      keep = litStart - copyCount * SYNC_BLOCK_SIZE;
+      //all pending: send it, to make room
+      if(keep == 0 && bufLen == STREAM_BUFFER_SIZE){
+        copied += flushPending(&ss, buf, copyFirst, copyCount, litStart, pos);
+        copyCount = 0;
+        litStart = keep = pos;
+      }
+      memmove(buf, buf + keep, bufLen - keep);
+      bufLen -= keep;
+      pos -= keep;
+      litStart -= keep;
+
+      n = fread(buf + bufLen, 1, STREAM_BUFFER_SIZE - bufLen, fptr);
+      addDigestBytes(&tree, buf + bufLen, n);
+      bufLen += n;
+      len += n;
+      eof = n == 0;
+      haveWeak = FALSE;
+      continue;
+    }
+    if(pos + SYNC_BLOCK_SIZE > bufLen){
+      break;
+    }
+    //nothing to match against: it's all data
+    if(manifest.numBlocks == 0){
+      pos = bufLen - SYNC_BLOCK_SIZE + 1;
+      continue;
+    }
+
+    if(!haveWeak){
+      weak = weakChecksum(buf + pos, SYNC_BLOCK_SIZE);
+      haveWeak = TRUE;
+    }
+
+    match = findBlock(&manifest, index, buf + pos, weak, copyFirst + copyCount);
+    if(match >= 0){
+      if(pos > litStart || (copyCount > 0 && match != copyFirst + copyCount) || copyCount == MAX_COPY_BLOCKS){
+        copied += flushPending(&ss, buf, copyFirst, copyCount, litStart, pos);
+        copyCount = 0;
+      }
+      if(copyCount == 0){
+        copyFirst = match;
+      }
+      copyCount++;
+      pos += SYNC_BLOCK_SIZE;
+      litStart = pos;
+      haveWeak = FALSE;
+    }
+    else{
+      //the byte past the window may not be read yet; if not, the weak checksum is recomputed after the refill
+      if(pos + SYNC_BLOCK_SIZE < bufLen){
+        weak = rollWeakChecksum(weak, buf[pos], buf[pos + SYNC_BLOCK_SIZE], SYNC_BLOCK_SIZE);
+      }
+      pos++;
+    }
+  }
+  copied += flushPending(&ss, buf, copyFirst, copyCount, litStart, bufLen);
+  getTreeDigest(&tree, digest);
+  if(ferror(fptr)){
+    printf("ERROR reading the input; only %lld bytes were read\r\n",len);
+  }
+
+  //end-to-end check: the receiver's ACK to our digest carries its own, once its output is on disk
+  digestToHex(digest, digestHex);
+  setSocketTimeout(sock,DIGEST_ACK_TIMEOUT_S,0);
+  verified = sessionSend(&ss, DIGEST, (byte*)digestHex, strlen(digestHex)) && strncmp((char*)ss.ackPkt.data, digestHex, 2 * SHA256_LEN) == 0 && !ferror(fptr);
+  setSocketTimeout(sock,0,ACK_TIMEOUT_US);
   
   printf("SEND COMPLETED!\r\n");
-}
+  if(verified){
+    printf("Digest verified: %s\r\n",digestHex);
+  }
+  else if(!ferror(fptr)){
+    printf("ERROR digest mismatch: sent %s but receiver has %s\r\n",digestHex,(char*)ss.ackPkt.data);
+  }
+  printf("Delta sync: %lld of %lld bytes copied from receiver's blocks, %lld bytes sent\r\n",copied,len,len - copied);
+  printLatencyStats(&ss.latencies);
+  printLinkStats(TRUE);
 
+  free(index);
+  freeManifest(&manifest);
+  free(buf);
+
+  return verified;
+}
 
 /*
 Must make sure the transmission delay is larger than the propagation delay.
@@ -305,30 +863,52 @@ Propagation delay constraint is why ethernet must be short range.
     3) return
 */
 int SendData(int sock, struct sockaddr_in* addr, int seqnum, byte* data)
+{
+  //the packet in which to receive ACK/NACK messages, exclusively
+  struct Packet ackPkt;
+
+  return SendRequest(sock,addr,seqnum,ACK,data,strnlen((char*)data,PKT_DATA_MAX_LEN),&ackPkt,NULL);
+}
+
+/*
+The general form of SendData: reliably sends a packet of some type (ACK for plain data, or MANIFEST/BLOCK_COPY)
+with dataLen bytes of data. On success, ackPkt holds the receiver's ACK, including any reply data. Fails at once
+if the receiver NACKs a BLOCK_COPY, ie can't make the copy. If ackWaitUs isn't NULL, it gets the
+time from the first send of the packet to the return of the awaitAck that accepted it; packet construction
+and logging fall outside that window.
+*/
+int SendRequest(int sock, struct sockaddr_in* addr, int seqnum, int type, const byte* data, int dataLen, struct Packet* ackPkt, long* ackWaitUs)
 {
   int response, retries, failure;
   int sendSuccessful;
   int state;
+  int timeouts, drops, bufferBefore;
+  unsigned int dropsBefore = linkStats.rxQueueDrops;
+  struct timespec start, end;
   //TODO: These belong in some c++ class
   const int SENDING = 1;
   const int AWAIT_ACK = 2;
 
   //the packet for sending data
   struct Packet txPkt;
-  //the packet in which to receive ACK/NACK messages, exclusively
-  struct Packet ackPkt;
   
   memset((void*)&txPkt,0,sizeof(struct Packet));
-  memset((void*)&ackPkt,0,sizeof(struct Packet));
+  memset((void*)ackPkt,0,sizeof(struct Packet));
   
-  makePacket(seqnum,ACK,data,&txPkt);
+  buildPacket(seqnum,type,data,dataLen,&txPkt);
+  printf("pkt source data: seqnum=%d ACK=%d datalen=%d\r\n",seqnum,type,dataLen);
+  printPacket(&txPkt);
 
   state = SENDING;
   sendSuccessful = FALSE;
   failure = FALSE;
   
+  printf("sender waiting for ack with seqnum=%d...\r\n",seqnum);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
   //The state machine for sending a single packet: send until a positive ACK is received
   retries = 0;
+  timeouts = 0;
   while(sendSuccessful != TRUE && retries < MAX_RETRY_COUNT && failure == FALSE){
 
     //send this packet
@@ -339,15 +919,23 @@ int SendData(int sock, struct sockaddr_in* addr, int seqnum, byte* data)
     //await packet acknowledgment from receiver        
     else if(state == AWAIT_ACK){
       //block with timeout for ACK/NACK
-      response = awaitAck(sock,addr,seqnum,&ackPkt);
+      response = awaitAck(sock,addr,seqnum,ackPkt);
       switch(response){
         case ACK:
+          clock_gettime(CLOCK_MONOTONIC, &end);
+          printf("Sender successfully received ACK packet\r\n");
           sendSuccessful = TRUE;
         break;
         
         //for all failure cases, just return to send state to re-send
         //TODO: add retry-count limit
         case NACK:
+          //the receiver refused this very BLOCK_COPY; resending it won't help
+          if(type == BLOCK_COPY && ackPkt->ack == NACK && bytesToLint(ackPkt->seqnum) == seqnum){
+            printf("Sender BLOCK_COPY refused by receiver\r\n");
+            failure = TRUE;
+            break;
+          }
           retries++;
           state = SENDING;
           break;
@@ -357,6 +945,7 @@ int SendData(int sock, struct sockaddr_in* addr, int seqnum, byte* data)
           break;
         case TIMEOUT:
           retries++;
+          timeouts++;
           state = SENDING;
           break;
         
@@ -371,6 +960,30 @@ int SendData(int sock, struct sockaddr_in* addr, int seqnum, byte* data)
         printf("ERROR unmapped state in _send()\r\n");
     }
   }
+  if(ackWaitUs != NULL){
+    if(!sendSuccessful){
+      clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    *ackWaitUs = elapsedUs(&start, &end);
+  }
+
+  /*
+  Classify the timeouts: the ACK that ended them carries the kernel's drop count, so any rise means acks
+  were lost to our own full receive queue rather than the path. Those are fixed locally, by growing the buffers.
+  */
+  if(timeouts > 0){
+    drops = (int)(linkStats.rxQueueDrops - dropsBefore);
+    drops = drops < timeouts ? drops : timeouts;
+    linkStats.localOverflows += drops;
+    linkStats.pathLosses += timeouts - drops;
+    if(drops > 0){
+      printf("WARN %d acks dropped by full receive queue, growing socket buffers\r\n",drops);
+      bufferBefore = linkStats.socketBuffer;
+      if(setSocketBuffers(sock, 2 * bufferBefore) <= bufferBefore){
+        printf("WARN socket buffers can't grow past %d bytes (net.core.rmem_max)\r\n",bufferBefore);
+      }
+    }
+  }
   
   return sendSuccessful && !failure;
 }
@@ -378,7 +991,8 @@ int SendData(int sock, struct sockaddr_in* addr, int seqnum, byte* data)
 /*
 Blocks until we receive an ACK packet from the destination, or timeout occurs.
 This implements the wait-for-ack state. We call recvfrom (without blocking) until
-we receive an uncorrupted ACK, NACK, or until a timout occurs.
+we receive an uncorrupted ACK, NACK, or until a timout occurs. In low-latency mode
+(see setBusyPoll) the wait spins for the busy-poll budget before blocking.
 
 
 Precondition: This function expects that sockfd is a socket with a timeout (socket for which
@@ -389,16 +1003,15 @@ Returns: ACK, NACK, TIMEOUT.
 int awaitAck(int sock, struct sockaddr_in* addr, int seqnum, struct Packet* ackPkt)
 {
   int rxed, result;
-  int sock_len = sizeof(struct sockaddr_in);
+  socklen_t sock_len = sizeof(struct sockaddr_in);
   char buf[RXTX_BUFFER_SIZE];
   int ack = NACK;
   
   memset(buf,0,RXTX_BUFFER_SIZE);
-  
-  printf("sender waiting for ack with seqnum=%d...\r\n",seqnum);
 
-  //block until we receive an ACK packet, or timeout occurs (returns -1)
-  rxed = recvfrom(sock,buf,RXTX_BUFFER_SIZE-1, 0, (struct sockaddr *)addr, &sock_len);
+  //no logging until the ack is in: SendRequest times this wait
+  //block (or spin, in low-latency mode) until we receive an ACK packet, or timeout occurs (returns -1)
+  rxed = recvBusyPoll(sock,buf,RXTX_BUFFER_SIZE-1,addr,&sock_len);
   
   //either a packet was received, or timeout occurred (other errors also possible, but timeout is most likely if packet was dropped)
   if(rxed > 0){
@@ -411,7 +1024,6 @@ int awaitAck(int sock, struct sockaddr_in* addr, int seqnum, struct Packet* ackP
     //check the packet's status
     //if(!isCorruptPacket(ackPkt)){
       if(isSequentialAck(ackPkt,seqnum)){
-        printf("Sender successfully received ACK packet\r\n");
         result = ACK;
       }
       else{
@@ -1,8 +1,14 @@
+#ifndef COMMON_H
+#define COMMON_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,9 +21,20 @@
 #define CORRUPT 3
 #define NOT_CORRUPT 4
 #define TIMEOUT 5
+//sender packet types for delta sync, carried in the ack field alongside ACK (plain data)
+//MANIFEST: requests the page of the receiver's block manifest starting at the block index in the data; the ACK carries the page
+#define MANIFEST 6
+//BLOCK_COPY: data is "first count"; the receiver copies that run of blocks from its existing data instead of receiving them, and NACKs it if it can't
+#define BLOCK_COPY 7
+//DIGEST: sent at session close with the sender's whole-file digest in hex; the ACK carries the receiver's digest
+#define DIGEST 8
 
 //the number of times the client will re-send a packet for which it hasn't received an ack
 #define MAX_RETRY_COUNT 1000 //basically infinity, for the sake of this assignment
+//how long the sender waits for an ACK before re-sending
+#define ACK_TIMEOUT_US 250000
+//the DIGEST's wait is longer: the receiver syncs its output to disk before answering, which takes time in proportion to the unsynced data
+#define DIGEST_ACK_TIMEOUT_S 5
 
 //TODO: get rid fo magic numbers and define maxes in terms of a single parameter, eg sizeof(struct Packet)
 #define PKT_DATA_MAX_LEN 65535
@@ -29,10 +46,50 @@
 #define SERVER_PORT 5432
 #define MAX_RX_LINE 256
 #define MAX_LINE 80
+//build with -DDBG=0 to disable the server's random ack drops (eg, for latency measurements)
+#ifndef DBG
 #define DBG 1
+#endif
+
+//packets a sender may have in flight; the alternating bit protocol is stop-and-wait
+#define TX_WINDOW 1
+//socket buffer bounds (bytes): the floor holds a full window of max-size packets (buffers are never shrunk below
+//the kernel default, either); the kernel may clamp the ceiling lower (net.core.rmem_max)
+#define MIN_SOCKET_BUFFER (TX_WINDOW * (RXTX_BUFFER_SIZE))
+#define MAX_SOCKET_BUFFER (4 * 1024 * 1024)
+
+//spin budget (us) for low-latency mode when enabled with "-l", before a receiver falls back to a blocking recvfrom
+#define BUSY_POLL_DEFAULT_US 50
+
+//latency histogram: 1us buckets below LATENCY_LINEAR_US, then LATENCY_SUB_BUCKETS per doubling up to LATENCY_DOUBLINGS more
+#define LATENCY_LINEAR_BITS 10
+#define LATENCY_LINEAR_US (1 << LATENCY_LINEAR_BITS)
+#define LATENCY_SUB_BITS 6
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_DOUBLINGS 32
+#define LATENCY_BUCKETS (LATENCY_LINEAR_US + LATENCY_DOUBLINGS * LATENCY_SUB_BUCKETS)
 
 typedef unsigned char byte;
 
+//Per-socket loss metrics: tells overflow of the local receive queue apart from loss on the path
+struct LinkStats{
+  //datagrams the kernel dropped because this socket's receive queue was full (from SO_RXQ_OVFL)
+  unsigned int rxQueueDrops;
+  //ACK waits that timed out, split into those explained by rxQueueDrops and the rest
+  int localOverflows;
+  int pathLosses;
+  //the receive buffer size the kernel last granted, in bytes (less its bookkeeping overhead)
+  int socketBuffer;
+};
+
+//Per-message latencies (in us), kept as a histogram so memory doesn't grow with the number of messages
+struct LatencyStats{
+  long counts[LATENCY_BUCKETS];
+  long numSamples;
+  long min;
+  long max;
+};
+
 //Let all U16's, etc, be represented by byte buffers of length mod 2; this makes it easy to htons/htonl, etc.
 //Read the 4-byte buffers from left to right: so 3 == [0,0,0,0011]
 struct Packet{
@@ -64,11 +121,25 @@ int bytesToLint(const byte buf[4]);
 void lintToBytes(const int i, byte obuf[4]);
 void setDataChecksum(struct Packet* pkt);
 void setSocketTimeout(int sockfd, int timeout_s, int timeout_us);
+void setBusyPoll(int sockfd, int budget_us);
+int parseBusyPollArg(const char* arg);
+int setSocketBuffers(int sockfd, int bytes);
+void enableDropCounting(int sockfd);
+const struct LinkStats* getLinkStats();
+void printLinkStats(int isSender);
+int recvBusyPoll(int sock, void* buf, int len, struct sockaddr_in* addr, socklen_t* addrLen);
+long elapsedUs(const struct timespec* start, const struct timespec* end);
+void recordLatency(struct LatencyStats* stats, long us);
+void printLatencyStats(const struct LatencyStats* stats);
 void printPacket(const struct Packet* pkt);
 void printRawPacket(const struct Packet* pkt);
 void makePacket(int seqnum, int ack, byte* data, struct Packet* pkt);
-void SendFile(FILE* fptr, int sock, struct sockaddr_in* sin);
+void buildPacket(int seqnum, int ack, const byte* data, int dataLen, struct Packet* pkt);
+int SendFile(FILE* fptr, int sock, struct sockaddr_in* sin);
 int SendData(int sock, struct sockaddr_in* addr, int seqnum, byte* data);
+int SendRequest(int sock, struct sockaddr_in* addr, int seqnum, int type, const byte* data, int dataLen, struct Packet* ackPkt, long* ackWaitUs);
 int awaitAck(int sock, struct sockaddr_in* addr, int seqnum, struct Packet* ackPkt);
 void cleanPacket(struct Packet* pkt);
 void sendPacket(struct Packet* pkt, int sock, struct sockaddr_in * sin);
+
+#endif
@@ -1,3 +1,3 @@
-gcc client_udp.c common.c -o client/cli
-gcc server_udp.c common.c -o server/svr
+gcc client_udp.c common.c manifest.c sha256.c -o client/cli
+gcc server_udp.c common.c manifest.c sha256.c -o server/svr
 
@@ -0,0 +1,447 @@
+#include "manifest.h"
+
+/*
+rsync's rolling checksum: a is the byte sum, b the sum of the running a's, both mod 2^16.
+Returns b in the high half and a in the low half.
+*/
+unsigned int weakChecksum(const byte* data, int len)
+{
+  int i;
+  unsigned int a = 0, b = 0;
+
+  for(i = 0; i < len; i++){
+    a += data[i];
+    b += (unsigned int)(len - i) * data[i];
+  }
+
+  return ((b & 0xFFFF) << 16) | (a & 0xFFFF);
+}
+
+//Slides a weak checksum's len-byte window forward one byte: drops byte "out", appends byte "in"
+unsigned int rollWeakChecksum(unsigned int weak, byte out, byte in, int len)
+{
+  unsigned int a = weak & 0xFFFF, b = weak >> 16;
+
+  a = (a - out + in) & 0xFFFF;
+  b = (b - (unsigned int)len * out + a) & 0xFFFF;
+
+  return (b << 16) | a;
+}
+
+/*
+64-bit FNV-1a. Not cryptographic, but only consulted when the weak checksums already match,
+so a false match between two non-adversarial blocks is vanishingly unlikely (and the SHA-256 file digest would catch it).
+*/
+unsigned long long strongHash(const byte* data, int len)
+{
+  int i;
+  unsigned long long hash = 14695981039346656037ULL;
+
+  for(i = 0; i < len; i++){
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+void initManifest(struct Manifest* m)
+{
+  memset((void*)m,0,sizeof(struct Manifest));
+}
+
+void freeManifest(struct Manifest* m)
+{
+  free(m->sigs);
+  initManifest(m);
+}
+
+void addBlockSig(struct Manifest* m, unsigned int weak, unsigned long long strong)
+{
+  if(m->numBlocks == m->maxBlocks){
+    m->maxBlocks = m->maxBlocks > 0 ? m->maxBlocks * 2 : 256;
+    m->sigs = (struct BlockSig*)realloc(m->sigs, m->maxBlocks * sizeof(struct BlockSig));
+    if(m->sigs == NULL){
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  m->sigs[m->numBlocks].weak = weak;
+  m->sigs[m->numBlocks].strong = strong;
+  m->numBlocks++;
+}
+
+//Hashes every full block of a file into m. Returns the number of blocks, or -1 if the file can't be read.
+int buildManifest(const char* fname, struct Manifest* m)
+{
+  byte block[SYNC_BLOCK_SIZE];
+  FILE* fp = fopen(fname, "r");
+
+  if(fp == NULL){
+    return -1;
+  }
+
+  while(fread(block, 1, SYNC_BLOCK_SIZE, fp) == SYNC_BLOCK_SIZE){
+    addBlockSig(m, weakChecksum(block, SYNC_BLOCK_SIZE), strongHash(block, SYNC_BLOCK_SIZE));
+  }
+  fclose(fp);
+
+  return m->numBlocks;
+}
+
+/*
+Loads the manifest kept on disk for fname (see BlockWriter), if it is still current: it must be no older
+than fname and list exactly one entry per full block of fname. Returns TRUE if loaded, else FALSE (m is left empty).
+*/
+int loadManifest(const char* manifestName, const char* fname, struct Manifest* m)
+{
+  char line[MANIFEST_ENTRY_LEN + 8];
+  unsigned int weak;
+  unsigned long long strong;
+  struct stat fileStat, manifestStat;
+  FILE* fp;
+
+  if(stat(fname, &fileStat) < 0 || stat(manifestName, &manifestStat) < 0 || manifestStat.st_mtime < fileStat.st_mtime){
+    return FALSE;
+  }
+
+  fp = fopen(manifestName, "r");
+  if(fp == NULL){
+    return FALSE;
+  }
+  while(fgets(line, sizeof(line), fp) != NULL && sscanf(line, "%8x%16llx", &weak, &strong) == 2){
+    addBlockSig(m, weak, strong);
+  }
+  fclose(fp);
+
+  if(m->numBlocks != fileStat.st_size / SYNC_BLOCK_SIZE){
+    printf("WARN stale manifest %s: %d entries for %d blocks\r\n",manifestName,m->numBlocks,(int)(fileStat.st_size / SYNC_BLOCK_SIZE));
+    freeManifest(m);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/*
+Writes the page of m starting at block "first" into out as a null-terminated hex string: the manifest's
+total block count and "first", then up to MANIFEST_PAGE_BLOCKS entries. Returns the number of entries written.
+*/
+int encodeManifestPage(const struct Manifest* m, int first, char* out, int outLen)
+{
+  int i, n = 0;
+
+  snprintf(out, outLen, "%08x%08x", m->numBlocks, first);
+  for(i = first; i >= 0 && i < m->numBlocks && n < MANIFEST_PAGE_BLOCKS; i++, n++){
+    if(MANIFEST_HEADER_LEN + (n + 1) * MANIFEST_ENTRY_LEN >= outLen){
+      break;
+    }
+    sprintf(out + MANIFEST_HEADER_LEN + n * MANIFEST_ENTRY_LEN, "%08x%016llx", m->sigs[i].weak, m->sigs[i].strong);
+  }
+
+  return n;
+}
+
+/*
+Appends the entries of a page made by encodeManifestPage to m. Returns the number of entries appended,
+or -1 if the page doesn't start at m's next block (eg, a late reply to an earlier request), leaving m as is.
+*/
+int decodeManifestPage(const char* page, struct Manifest* m, int* totalBlocks)
+{
+  int n = 0;
+  unsigned int total, first;
+  unsigned long long strong;
+  unsigned int weak;
+
+  if(sscanf(page, "%8x%8x", &total, &first) != 2){
+    *totalBlocks = 0;
+    return 0;
+  }
+  if((int)first != m->numBlocks){
+    return -1;
+  }
+  *totalBlocks = (int)total;
+
+  page += MANIFEST_HEADER_LEN;
+  while(strnlen(page, MANIFEST_ENTRY_LEN) == MANIFEST_ENTRY_LEN && sscanf(page, "%8x%16llx", &weak, &strong) == 2){
+    addBlockSig(m, weak, strong);
+    page += MANIFEST_ENTRY_LEN;
+    n++;
+  }
+
+  return n;
+}
+
+void initTreeDigest(struct TreeDigest* d)
+{
+  memset((void*)d,0,sizeof(struct TreeDigest));
+}
+
+//Leaf of the digest tree: the SHA-256 of a 0x00 byte and the chunk, as in RFC 6962
+static void hashLeaf(const byte* chunk, int len, byte out[SHA256_LEN])
+{
+  const byte prefix = 0x00;
+  struct Sha256 h;
+
+  initSha256(&h);
+  updateSha256(&h, &prefix, 1);
+  updateSha256(&h, chunk, len);
+  finishSha256(&h, out);
+}
+
+//Interior node of the digest tree: the SHA-256 of a 0x01 byte and its children, so no node can pass for a leaf
+static void hashPair(const byte left[SHA256_LEN], const byte right[SHA256_LEN], byte out[SHA256_LEN])
+{
+  const byte prefix = 0x01;
+  struct Sha256 h;
+
+  initSha256(&h);
+  updateSha256(&h, &prefix, 1);
+  updateSha256(&h, left, SHA256_LEN);
+  updateSha256(&h, right, SHA256_LEN);
+  finishSha256(&h, out);
+}
+
+//Appends a leaf, then merges equal-sized subtrees: one merge per trailing zero bit of the new leaf count
+static void addLeaf(struct TreeDigest* d, const byte* chunk, int len)
+{
+  long long n;
+
+  hashLeaf(chunk, len, d->roots[d->numRoots++]);
+  d->numLeaves++;
+  for(n = d->numLeaves; n % 2 == 0; n /= 2){
+    hashPair(d->roots[d->numRoots - 2], d->roots[d->numRoots - 1], d->roots[d->numRoots - 2]);
+    d->numRoots--;
+  }
+}
+
+//Adds the next len bytes of the file to the digest
+void addDigestBytes(struct TreeDigest* d, const byte* data, int len)
+{
+  int n;
+
+  d->length += len;
+  while(len > 0){
+    n = SYNC_BLOCK_SIZE - d->chunkLen < len ? SYNC_BLOCK_SIZE - d->chunkLen : len;
+    memcpy(d->chunk + d->chunkLen, data, n);
+    d->chunkLen += n;
+    data += n;
+    len -= n;
+
+    if(d->chunkLen == SYNC_BLOCK_SIZE){
+      addLeaf(d, d->chunk, SYNC_BLOCK_SIZE);
+      d->chunkLen = 0;
+    }
+  }
+}
+
+/*
+Writes the digest of everything added so far to out, without changing d: the SHA-256 of a 0x02 byte, the total
+length (8 bytes, big-endian) and the root of the tree. A short last chunk is the last leaf. The root folds the
+subtree roots from the right, which gives the tree that pairs adjacent nodes level by level, carrying an odd node
+out up as-is. The tree of an empty file is the SHA-256 of no bytes.
+*/
+void getTreeDigest(const struct TreeDigest* d, byte out[SHA256_LEN])
+{
+  int i;
+  byte prefix[9];
+  byte root[SHA256_LEN];
+  struct Sha256 h;
+
+  if(d->chunkLen > 0){
+    hashLeaf(d->chunk, d->chunkLen, root);
+    i = d->numRoots - 1;
+  }
+  else if(d->numRoots > 0){
+    memcpy(root, d->roots[d->numRoots - 1], SHA256_LEN);
+    i = d->numRoots - 2;
+  }
+  else{
+    initSha256(&h);
+    finishSha256(&h, root);
+    i = -1;
+  }
+  for(; i >= 0; i--){
+    hashPair(d->roots[i], root, root);
+  }
+
+  prefix[0] = 0x02;
+  for(i = 0; i < 8; i++){
+    prefix[1 + i] = (byte)((unsigned long long)d->length >> (56 - 8 * i));
+  }
+  initSha256(&h);
+  updateSha256(&h, prefix, sizeof(prefix));
+  updateSha256(&h, root, SHA256_LEN);
+  finishSha256(&h, out);
+}
+
+void digestToHex(const byte digest[SHA256_LEN], char hex[2 * SHA256_LEN + 1])
+{
+  int i;
+
+  for(i = 0; i < SHA256_LEN; i++){
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+}
+
+//Truncates/creates the output file and its manifest. Returns FALSE if either can't be opened.
+int openBlockWriter(struct BlockWriter* w, const char* fname, const char* manifestName)
+{
+  memset((void*)w,0,sizeof(struct BlockWriter));
+
+  w->fp = fopen(fname, "w");
+  w->manifestFp = fopen(manifestName, "w");
+
+  return w->fp != NULL && w->manifestFp != NULL;
+}
+
+//Writes data to the output. Any write error marks the writer failed, so the output won't verify.
+void writeBlocks(struct BlockWriter* w, const byte* data, int len)
+{
+  int n;
+
+  if(fwrite(data, 1, len, w->fp) != len){
+    printf("fwrite() error\n");
+    w->failed = TRUE;
+  }
+  addDigestBytes(&w->digest, data, len);
+
+  while(len > 0){
+    n = SYNC_BLOCK_SIZE - w->blockLen < len ? SYNC_BLOCK_SIZE - w->blockLen : len;
+    memcpy(w->block + w->blockLen, data, n);
+    w->blockLen += n;
+    data += n;
+    len -= n;
+
+    //block complete: flush the data before its manifest entry, so the manifest never lists blocks the file doesn't have
+    if(w->blockLen == SYNC_BLOCK_SIZE){
+      if(fflush(w->fp) == EOF){
+        perror("fflush");
+        w->failed = TRUE;
+      }
+      fprintf(w->manifestFp, "%08x%016llx\n", weakChecksum(w->block, SYNC_BLOCK_SIZE), strongHash(w->block, SYNC_BLOCK_SIZE));
+      fflush(w->manifestFp);
+      w->blockLen = 0;
+    }
+  }
+}
+
+void initBasis(struct Basis* b)
+{
+  memset((void*)b,0,sizeof(struct Basis));
+}
+
+/*
+Adds a file to the end of the basis, with its manifest: the one kept alongside it (see BlockWriter) if still
+current, else hashed fresh. Returns FALSE if there is no such file, or the basis is full.
+*/
+int addBasisFile(struct Basis* b, const char* fname, const char* manifestName)
+{
+  int i;
+  struct Manifest own;
+  FILE* fp;
+
+  if(b->numFiles == MAX_BASIS_FILES || (fp = fopen(fname, "r")) == NULL){
+    return FALSE;
+  }
+
+  initManifest(&own);
+  if(!loadManifest(manifestName, fname, &own)){
+    buildManifest(fname, &own);
+  }
+  b->fps[b->numFiles] = fp;
+  b->firstBlocks[b->numFiles] = b->manifest.numBlocks;
+  b->numFiles++;
+  for(i = 0; i < own.numBlocks; i++){
+    addBlockSig(&b->manifest, own.sigs[i].weak, own.sigs[i].strong);
+  }
+  freeManifest(&own);
+
+  return TRUE;
+}
+
+void closeBasis(struct Basis* b)
+{
+  int i;
+
+  for(i = 0; i < b->numFiles; i++){
+    fclose(b->fps[i]);
+  }
+  freeManifest(&b->manifest);
+  initBasis(b);
+}
+
+/*
+Writes count blocks of the basis, starting at block first, to the output. A run may cross from one basis file
+into the next. Returns FALSE, having written nothing, if the run isn't in the manifest; a read error partway
+also returns FALSE, and marks the writer failed since the blocks before it were already written.
+*/
+int copyBlocks(struct Basis* b, int first, int count, struct BlockWriter* w)
+{
+  int i, f, end;
+  byte block[SYNC_BLOCK_SIZE];
+
+  if(first < 0 || count <= 0 || first > b->manifest.numBlocks - count){
+    printf("ERROR no basis blocks %d to %d to copy\r\n",first,first + count - 1);
+    return FALSE;
+  }
+
+  for(i = first; i < first + count; ){
+    //the file holding block i, and where its blocks (or this run) end
+    for(f = b->numFiles - 1; f > 0 && b->firstBlocks[f] > i; f--);
+    end = f + 1 < b->numFiles ? b->firstBlocks[f + 1] : b->manifest.numBlocks;
+    end = end < first + count ? end : first + count;
+
+    if(fseek(b->fps[f], (long)(i - b->firstBlocks[f]) * SYNC_BLOCK_SIZE, SEEK_SET) < 0){
+      printf("ERROR can't seek to basis block %d\r\n",i);
+      w->failed |= i > first;
+      return FALSE;
+    }
+    for(; i < end; i++){
+      if(fread(block, 1, SYNC_BLOCK_SIZE, b->fps[f]) != SYNC_BLOCK_SIZE){
+        printf("ERROR short read copying basis block %d\r\n",i);
+        w->failed |= i > first;
+        return FALSE;
+      }
+      writeBlocks(w, block, SYNC_BLOCK_SIZE);
+    }
+  }
+
+  return TRUE;
+}
+
+//Writes the digest of everything written so far, including a short tail block, to out. Doesn't change the writer.
+void getWriterDigest(const struct BlockWriter* w, byte out[SHA256_LEN])
+{
+  getTreeDigest(&w->digest, out);
+}
+
+//Flushes the output through to disk. Returns FALSE if that, or any earlier write, failed.
+int syncBlockWriter(struct BlockWriter* w)
+{
+  if(fflush(w->fp) == EOF || fsync(fileno(w->fp)) < 0){
+    perror("sync output");
+    w->failed = TRUE;
+  }
+
+  return !w->failed;
+}
+
+//Returns FALSE if closing the output, or any earlier write, failed.
+int closeBlockWriter(struct BlockWriter* w)
+{
+  if(w->fp != NULL && fclose(w->fp) == EOF){
+    perror("fclose");
+    w->failed = TRUE;
+  }
+  //closing fp may have flushed a tail block; touch the manifest so it still reads as current to loadManifest
+  if(w->manifestFp != NULL){
+    futimens(fileno(w->manifestFp), NULL);
+    fclose(w->manifestFp);
+  }
+  w->fp = NULL;
+  w->manifestFp = NULL;
+
+  return !w->failed;
+}
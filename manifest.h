@@ -0,0 +1,108 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "common.h"
+#include "sha256.h"
+#include <sys/stat.h>
+
+//Block size for delta sync: the receiver's manifest has one signature per full block of its file
+#define SYNC_BLOCK_SIZE 512
+//hex chars per manifest entry: 8 for the weak checksum, 16 for the strong hash
+#define MANIFEST_ENTRY_LEN 24
+//hex chars heading each manifest page: the total block count of the manifest, then the index of the page's first block
+#define MANIFEST_HEADER_LEN 16
+//max entries per manifest page; a page must fit in one packet's data
+#define MANIFEST_PAGE_BLOCKS 2048
+//max blocks per BLOCK_COPY, so the receiver makes each copy and acks it well inside the sender's ack timeout
+#define MAX_COPY_BLOCKS MANIFEST_PAGE_BLOCKS
+//bytes of input a sender holds at once: room for a full copy run (kept until acked) plus as much again of data and lookahead
+#define STREAM_BUFFER_SIZE (2 * MAX_COPY_BLOCKS * SYNC_BLOCK_SIZE)
+//files a receiver's basis may span: its previous complete output, and the partial output of an interrupted resend
+#define MAX_BASIS_FILES 2
+
+//The signature of one block: an rsync-style rolling weak checksum, and a strong hash to confirm weak matches
+struct BlockSig{
+  unsigned int weak;
+  unsigned long long strong;
+};
+
+//Per-block signatures of a file, in file order. Only full blocks are listed; a short tail block is never matched.
+struct Manifest{
+  int numBlocks;
+  int maxBlocks;
+  struct BlockSig* sigs;
+};
+
+/*
+The receiver's existing data, which BLOCK_COPYs draw from: its previous complete output and, if a resend was
+interrupted, that run's partial output. Their manifests are concatenated in that order, so a block index
+names a block of either file.
+*/
+struct Basis{
+  int numFiles;
+  FILE* fps[MAX_BASIS_FILES];
+  //the index of each file's first block in the manifest
+  int firstBlocks[MAX_BASIS_FILES];
+  struct Manifest manifest;
+};
+
+//the deepest digest tree: one with 2^64 leaves
+#define MAX_DIGEST_DEPTH 64
+
+/*
+End-to-end digest of a file: a SHA-256 hash tree over its SYNC_BLOCK_SIZE chunks (the last may be short), with the
+file length mixed into the root. The file is streamed through in order, and only the roots of the complete subtrees
+so far are kept (one per set bit of the leaf count), so the digest needs the same memory for any file size.
+*/
+struct TreeDigest{
+  long long numLeaves;
+  //roots of the complete subtrees, largest (leftmost) first
+  int numRoots;
+  byte roots[MAX_DIGEST_DEPTH][SHA256_LEN];
+  //the chunk being filled, not yet a leaf
+  byte chunk[SYNC_BLOCK_SIZE];
+  int chunkLen;
+  //total bytes added
+  long long length;
+};
+
+/*
+Writes a stream to the receiver's output file, keeping that file's manifest on disk current as each
+block fills. If a transfer is interrupted, the partial file and its manifest are the basis for resuming.
+*/
+struct BlockWriter{
+  FILE* fp;
+  FILE* manifestFp;
+  byte block[SYNC_BLOCK_SIZE];
+  int blockLen;
+  //digest over everything written so far
+  struct TreeDigest digest;
+  //set if the output may be missing data it was handed: a failed write, flush or sync, or a BLOCK_COPY that failed partway
+  int failed;
+};
+
+unsigned int weakChecksum(const byte* data, int len);
+unsigned int rollWeakChecksum(unsigned int weak, byte out, byte in, int len);
+unsigned long long strongHash(const byte* data, int len);
+void initManifest(struct Manifest* m);
+void freeManifest(struct Manifest* m);
+void addBlockSig(struct Manifest* m, unsigned int weak, unsigned long long strong);
+int buildManifest(const char* fname, struct Manifest* m);
+int loadManifest(const char* manifestName, const char* fname, struct Manifest* m);
+int encodeManifestPage(const struct Manifest* m, int first, char* out, int outLen);
+int decodeManifestPage(const char* page, struct Manifest* m, int* totalBlocks);
+void initTreeDigest(struct TreeDigest* d);
+void addDigestBytes(struct TreeDigest* d, const byte* data, int len);
+void getTreeDigest(const struct TreeDigest* d, byte out[SHA256_LEN]);
+void digestToHex(const byte digest[SHA256_LEN], char hex[2 * SHA256_LEN + 1]);
+int openBlockWriter(struct BlockWriter* w, const char* fname, const char* manifestName);
+void writeBlocks(struct BlockWriter* w, const byte* data, int len);
+void initBasis(struct Basis* b);
+int addBasisFile(struct Basis* b, const char* fname, const char* manifestName);
+void closeBasis(struct Basis* b);
+int copyBlocks(struct Basis* b, int first, int count, struct BlockWriter* w);
+void getWriterDigest(const struct BlockWriter* w, byte out[SHA256_LEN]);
+int syncBlockWriter(struct BlockWriter* w);
+int closeBlockWriter(struct BlockWriter* w);
+
+#endif
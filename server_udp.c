@@ -1,24 +1,50 @@
-#include "common.h"
+#include "manifest.h"
+
+//Renames a file and its manifest, replacing any manifest already under the new name
+static void setAside(const char* fname, const char* manifestName, const char* newName, const char* newManifestName)
+{
+  rename(fname, newName);
+  remove(newManifestName);
+  rename(manifestName, newManifestName);
+}
 
 int main(int argc, char * argv[])
 {
   char *fname;
-  byte buf[MAX_RX_LINE];
-  byte ackBuf[RXTX_BUFFER_SIZE];
+  //sized for a whole packet, since deserializePacket copies sizeof(struct Packet) bytes out of it
+  byte buf[RXTX_BUFFER_SIZE];
   struct sockaddr_in sin;
-  int len, dataLen, receiverSeqnum, firstSeqnum;
+  int len, dataLen, receiverSeqnum, firstSeqnum, isNew, ackType;
   int s, i;
   struct timeval tv;
   char seq_num = 1; 
-  FILE *fp;
   struct Packet ackPkt;
   struct Packet rxPkt;
+  int busyPollUs = 0;
+  //delta sync state: the previous output file (and any partial output of an interrupted resend) is the basis the sender diffs against
+  char basisName[FILENAME_MAX];
+  char basisManifestName[FILENAME_MAX];
+  char partialName[FILENAME_MAX];
+  char partialManifestName[FILENAME_MAX];
+  char manifestName[FILENAME_MAX];
+  char manifestPage[PKT_DATA_MAX_LEN];
+  char digestHex[MAX_LINE];
+  byte digest[SHA256_LEN];
+  int verified = FALSE;
+  struct Basis basis;
+  struct BlockWriter writer;
+  struct stat outputStat, basisStat, partialStat;
+  int copyFirst, copyCount;
 
-  if (argc==2) {
+  if (argc==2 || argc==3) {
     fname = argv[1];
+    //optional: low-latency mode, spinning up to this many us (or BUSY_POLL_DEFAULT_US, for "-l") for each packet before blocking
+    if (argc==3) {
+      busyPollUs = parseBusyPollArg(argv[2]);
+    }
   }
   else {
-    fprintf(stderr, "usage: ./server_udp filename\n");
+    fprintf(stderr, "usage: ./server_udp filename [-l | busy_poll_us]\n");
     exit(1);
   }
 
@@ -39,10 +65,37 @@ int main(int argc, char * argv[])
   }
 
   socklen_t sock_len = sizeof sin;
+  setBusyPoll(s,busyPollUs);
+  //a stop-and-wait sender never has more than a window of packets in flight, so that bounds the receive queue (the kernel default may already hold more)
+  setSocketBuffers(s,MIN_SOCKET_BUFFER);
+  enableDropCounting(s);
   srandom(time(NULL));
 
-  fp = fopen(fname, "w");
-  if (fp==NULL){
+  /*
+  Set aside any existing output, with its manifest, for the sender to copy from. Normally that's the previous
+  complete output, which becomes the basis. But a basis left in place means the last run was interrupted, and
+  the output is just that run's partial: keep the basis, which likely has the rest of the file, and set the
+  partial aside next to it (unless an earlier partial got further).
+  */
+  snprintf(basisName, FILENAME_MAX, "%s.basis", fname);
+  snprintf(basisManifestName, FILENAME_MAX, "%s.basis.manifest", fname);
+  snprintf(partialName, FILENAME_MAX, "%s.partial", fname);
+  snprintf(partialManifestName, FILENAME_MAX, "%s.partial.manifest", fname);
+  snprintf(manifestName, FILENAME_MAX, "%s.manifest", fname);
+  if(stat(fname, &outputStat) == 0 && outputStat.st_size > 0){
+    if(stat(basisName, &basisStat) < 0){
+      setAside(fname, manifestName, basisName, basisManifestName);
+    }
+    else if(stat(partialName, &partialStat) < 0 || outputStat.st_size >= partialStat.st_size){
+      setAside(fname, manifestName, partialName, partialManifestName);
+    }
+  }
+  initBasis(&basis);
+  addBasisFile(&basis, basisName, basisManifestName);
+  addBasisFile(&basis, partialName, partialManifestName);
+  printf("Basis has %d blocks of %d bytes in %d files\r\n",basis.manifest.numBlocks,SYNC_BLOCK_SIZE,basis.numFiles);
+
+  if (!openBlockWriter(&writer, fname, manifestName)){
     printf("Can't open file\n");
     exit(1);
   }
@@ -61,13 +114,14 @@ int main(int argc, char * argv[])
       treat as end of transmission, and exit comm loop
     else:
       -deserialize packet from rx message
-      -write packet data to file
       -send ACK to sender
+      -write packet data to file
       -go back to wait for input
+  The ACK goes out before any logging or file io, so the sender's wait is as short as possible. The exception is
+  a new BLOCK_COPY, which is only acked once the copy is made, and NACKed if it can't be.
   */
   while(1){
-    len = recvfrom(s, buf, sizeof(buf), 0, (struct sockaddr *)&sin, &sock_len);
-    printf("rxed pkt of len=%d\r\n",len);
+    len = recvBusyPoll(s, buf, sizeof(buf), &sin, &sock_len);
     if(len == -1){
       perror("PError");
     }
@@ -86,9 +140,12 @@ int main(int argc, char * argv[])
         printf("Server dropped packet...");
       }
       else{
-        //deserialize the received packet
+        //deserialize the received packet, and null terminate its data
         deserializePacket(buf,&rxPkt);
-        
+        dataLen = bytesToLint(rxPkt.dataLen);
+        dataLen = dataLen < PKT_DATA_MAX_LEN ? dataLen : (PKT_DATA_MAX_LEN - 1);
+        rxPkt.data[dataLen] = '\0';
+
         //seqnum is part of the receiver's state, and must be initialized in alignment with the sender; this bootstraps it on the first received packet.
         //Subsequent packets are aligned with this seqnum, rejecting dupes that are re-sent if the receiver ACK packet is dropped.
         if(firstSeqnum){
@@ -96,24 +153,66 @@ int main(int argc, char * argv[])
           //careful here: we write data to file based on a new seqnum; so don't initialize seqnum to rxPkt.seqnum, or the first line will not be written
           receiverSeqnum = (bytesToLint(rxPkt.seqnum) + 1) % 2;
         }
-        printf("Receiver RXED client packet, seqnum=%d:  >%s<\r\n",bytesToLint(rxPkt.seqnum),rxPkt.data);
-        printPacket(&rxPkt);
+        isNew = receiverSeqnum != bytesToLint(rxPkt.seqnum);
 
-        //send ACK for every packet received
+        //send ACK for every packet received; a MANIFEST request's ACK carries the requested page
         //remember even the ACK could be dropped; hence sender needs to implement a timeout while waiting for ACK
-        makePacket(bytesToLint(rxPkt.seqnum), ACK, 0, &ackPkt);
-        serializePacket(&ackPkt,ackBuf);
+        //ACKs are built with buildPacket, which doesn't log; everything is logged once the ACK is out
+        ackType = ACK;
+        if(rxPkt.ack == MANIFEST){
+          encodeManifestPage(&basis.manifest, atoi((char*)rxPkt.data), manifestPage, PKT_DATA_MAX_LEN - 32);
+          buildPacket(bytesToLint(rxPkt.seqnum), ACK, (byte*)manifestPage, strlen(manifestPage), &ackPkt);
+        }
+        //a DIGEST comes last, after all data is written; answer with the output's digest so the sender can compare too.
+        //The output is synced to disk first (the sender waits DIGEST_ACK_TIMEOUT_S for this ACK, not the usual ACK_TIMEOUT_US),
+        //and if any of it failed to be written, the answer is an error, not a digest.
+        else if(rxPkt.ack == DIGEST){
+          if(!syncBlockWriter(&writer)){
+            snprintf(digestHex, MAX_LINE, "ERROR output not fully written");
+          }
+          else{
+            getWriterDigest(&writer, digest);
+            digestToHex(digest, digestHex);
+          }
+          buildPacket(bytesToLint(rxPkt.seqnum), ACK, (byte*)digestHex, strlen(digestHex), &ackPkt);
+        }
+        //apply a new BLOCK_COPY before acking it; if the copy can't be made, the NACK has the sender send those bytes instead
+        else if(rxPkt.ack == BLOCK_COPY && isNew){
+          if(sscanf((char*)rxPkt.data, "%d %d", &copyFirst, &copyCount) != 2 || !copyBlocks(&basis, copyFirst, copyCount, &writer)){
+            ackType = NACK;
+          }
+          buildPacket(bytesToLint(rxPkt.seqnum), ackType, 0, 0, &ackPkt);
+        }
+        else{
+          buildPacket(bytesToLint(rxPkt.seqnum), ACK, 0, 0, &ackPkt);
+        }
         sendPacket(&ackPkt,s,&sin);
+        printf("rxed pkt of len=%d, sent %s seqnum=%d\r\n",len,ackType == ACK ? "ACK" : "NACK",bytesToLint(ackPkt.seqnum));
+        printf("Receiver RXED client packet, seqnum=%d:  >%s<\r\n",bytesToLint(rxPkt.seqnum),rxPkt.data);
+        printPacket(&rxPkt);
 
-        //if this is a new packet, copy the packet data to file (making sure to null terminate it)
-        if(receiverSeqnum != bytesToLint(rxPkt.seqnum)){
+        //if this is a new packet, copy the packet data to file (BLOCK_COPYs were already applied above)
+        //MANIFEST requests were fully handled by their ACK, but still take a seqnum; a refused BLOCK_COPY doesn't
+        if(isNew && ackType == NACK){
+          printf("Receiver refused BLOCK_COPY of %s\r\n",(char*)rxPkt.data);
+        }
+        else if(isNew){
           //receiverSeqnum = bytesToLint(rxPkt.seqnum);
-          dataLen = bytesToLint(rxPkt.dataLen);
-          dataLen = dataLen < PKT_DATA_MAX_LEN ? dataLen : (PKT_DATA_MAX_LEN - 1);
-          rxPkt.data[dataLen] = '\0';
-          printf("Receiver rx'ed data: %s\r\n",(char*)rxPkt.data);
-          if(fputs((char *)rxPkt.data, fp) < 1){
-            printf("fputs() error\n");
+          if(rxPkt.ack == BLOCK_COPY){
+            printf("Receiver copied %d basis blocks from block %d\r\n",copyCount,copyFirst);
+          }
+          else if(rxPkt.ack == DIGEST){
+            verified = strncmp((char*)rxPkt.data, digestHex, 2 * SHA256_LEN) == 0;
+            if(verified){
+              printf("Digest verified: %s\r\n",digestHex);
+            }
+            else{
+              printf("ERROR digest mismatch: sender has %s but output has %s\r\n",(char*)rxPkt.data,digestHex);
+            }
+          }
+          else if(rxPkt.ack == ACK){
+            printf("Receiver rx'ed data: %s\r\n",(char*)rxPkt.data);
+            writeBlocks(&writer, rxPkt.data, dataLen);
           }
 
           //update the seqnum; for the alternating bit protocol, the seqnum just alternates between 0 and 1
@@ -126,6 +225,24 @@ int main(int argc, char * argv[])
     }
   }
 
-  fclose(fp);
+  if(!closeBlockWriter(&writer)){
+    printf("ERROR closing output\r\n");
+    verified = FALSE;
+  }
+  closeBasis(&basis);
+  //the manifest lists what was written, which isn't what's on disk if the digests disagree; drop it so the next run rehashes.
+  //Keep the basis too: the next run then treats the output like an interrupted one's partial.
+  if(!verified){
+    printf("WARN output not verified against the sender's digest\r\n");
+    remove(manifestName);
+  }
+  //the output is complete and verified, so the basis is no longer needed
+  else{
+    remove(basisName);
+    remove(basisManifestName);
+    remove(partialName);
+    remove(partialManifestName);
+  }
+  printLinkStats(FALSE);
   close(s);
 }
@@ -0,0 +1,95 @@
+#include "sha256.h"
+
+static const unsigned int roundConstants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+//Runs the compression function over one 64-byte block
+static void compressBlock(unsigned int state[8], const byte block[64])
+{
+  int i;
+  unsigned int w[64], a, b, c, d, e, f, g, h, t1, t2;
+
+  for(i = 0; i < 16; i++){
+    w[i] = ((unsigned int)block[4 * i] << 24) | ((unsigned int)block[4 * i + 1] << 16) | ((unsigned int)block[4 * i + 2] << 8) | block[4 * i + 3];
+  }
+  for(i = 16; i < 64; i++){
+    w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+         + w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+  }
+
+  a = state[0]; b = state[1]; c = state[2]; d = state[3];
+  e = state[4]; f = state[5]; g = state[6]; h = state[7];
+  for(i = 0; i < 64; i++){
+    t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + roundConstants[i] + w[i];
+    t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void initSha256(struct Sha256* h)
+{
+  static const unsigned int initialState[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memset((void*)h,0,sizeof(struct Sha256));
+  memcpy(h->state, initialState, sizeof(initialState));
+}
+
+void updateSha256(struct Sha256* h, const byte* data, int len)
+{
+  int n;
+
+  h->length += len;
+  while(len > 0){
+    n = 64 - h->blockLen < len ? 64 - h->blockLen : len;
+    memcpy(h->block + h->blockLen, data, n);
+    h->blockLen += n;
+    data += n;
+    len -= n;
+
+    if(h->blockLen == 64){
+      compressBlock(h->state, h->block);
+      h->blockLen = 0;
+    }
+  }
+}
+
+//Pads the message (a 1 bit, zeros, then the 64-bit big-endian bit length) and writes the hash to out
+void finishSha256(struct Sha256* h, byte out[SHA256_LEN])
+{
+  int i;
+  unsigned long long bits = h->length * 8;
+
+  h->block[h->blockLen++] = 0x80;
+  if(h->blockLen > 56){
+    memset(h->block + h->blockLen, 0, 64 - h->blockLen);
+    compressBlock(h->state, h->block);
+    h->blockLen = 0;
+  }
+  memset(h->block + h->blockLen, 0, 56 - h->blockLen);
+  for(i = 0; i < 8; i++){
+    h->block[56 + i] = (byte)(bits >> (56 - 8 * i));
+  }
+  compressBlock(h->state, h->block);
+
+  for(i = 0; i < 8; i++){
+    out[4 * i] = (byte)(h->state[i] >> 24);
+    out[4 * i + 1] = (byte)(h->state[i] >> 16);
+    out[4 * i + 2] = (byte)(h->state[i] >> 8);
+    out[4 * i + 3] = (byte)h->state[i];
+  }
+}
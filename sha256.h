@@ -0,0 +1,21 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include "common.h"
+
+//bytes in a SHA-256 hash
+#define SHA256_LEN 32
+
+//Incremental SHA-256 (FIPS 180-4): init, update with any number of byte runs, then finish
+struct Sha256{
+  unsigned int state[8];
+  unsigned long long length;
+  byte block[64];
+  int blockLen;
+};
+
+void initSha256(struct Sha256* h);
+void updateSha256(struct Sha256* h, const byte* data, int len);
+void finishSha256(struct Sha256* h, byte out[SHA256_LEN]);
+
+#endif